@@ -9,6 +9,8 @@ struct File {
   bool isDir;
   byte dataSize;
   uint16_t dataStartAddr;
+  byte header;
+  uint16_t extentAddr; // shared extent the data lives in, 0 if the file owns its data
 };
 
 // writebuffer is disabled (replace rd/wr ops below)
@@ -16,7 +18,8 @@ const int8_t BUFFER_SIZE = 30;
 uint16_t writeBufferAddr[BUFFER_SIZE];
 uint16_t writeBufferValue[BUFFER_SIZE];
 uint8_t writeBufferPointer = 0;
-uint16_t totalWriteCycles = 0;
+uint32_t totalWriteCycles = 0;
+uint32_t metaWriteCycles = 0; // physical writes to metadata home addresses
 
 String command[5];
 String commandString;
@@ -27,8 +30,69 @@ byte cwdPointer = 0;
 
 const uint8_t HEADER_SIZE = 5;
 
+// File header byte flags
+const uint8_t HDR_DIR = 0;
+const uint8_t HDR_SHARED = 1; // file data is a 2 byte pointer to a shared extent
+const uint8_t HDR_PACKED_NAME = 2; // name stored as 6 bit codes
+const uint8_t HDR_PACKED_DATA = 3; // data stored as [length][6 bit codes]
+const uint8_t HDR_RLE_DATA = 4; // data stored as [length][run length encoded data]
+const uint8_t HDR_CRC = 5; // record ends with a CRC8 of the file (see fileCrc)
+const byte DATA_ENCODING_MASK = 1<<HDR_PACKED_DATA | 1<<HDR_RLE_DATA;
+
+// Shared extents are laid out as [refcount][dataSize][data...]
+const uint8_t EXTENT_HEADER_SIZE = 2;
+// Smallest data size for which sharing saves memory over a plain copy
+const uint8_t SHARE_MIN_SIZE = 7;
+
 uint8_t allocMap[128];
 
+bool fsMounted = false;
+bool fsNeedsCheck = false; // tree found inconsistent, changes are refused until fsck passes
+bool crcNewFiles = false;
+
+// Depth first tree walk without recursion: a stack of (dir address, entry index),
+// 3 bytes per level. Paths are rebuilt by re-reading the names of the stacked dirs
+const uint8_t WALK_DEPTH = 16;
+struct TreeWalk {
+  uint16_t dir[WALK_DEPTH];
+  uint8_t index[WALK_DEPTH];
+  uint8_t depth;
+};
+
+// Incremental scrub: verifies SCRUB_BATCH files per loop() iteration, resuming
+// its walk between iterations
+const uint8_t SCRUB_BATCH = 1;
+bool scrubEnabled = true;
+struct TreeWalk scrubWalk;
+uint16_t scrubPasses = 0;
+uint16_t scrubErrors = 0; // errors found in the last complete pass
+uint16_t scrubPassErrors = 0; // errors found so far in the current pass
+uint16_t scrubLastBad = 0; // address of the last bad file found
+
+// Log mode (selected at mkfs): metadata updates are appended to a circular log
+// in front of the fs terminator instead of rewriting hot spots in place, and
+// folded back to their home addresses at checkpoints.
+const uint8_t FS_MAGIC = 0xFF;
+const uint8_t FS_MAGIC_LOG = 0xFD;
+// Records are [6 bit seq | 2 bit addr high][addr low][value], seq 0 marks an unused slot
+const uint8_t LOG_RECORDS = 24;
+const uint8_t LOG_RECORD_SIZE = 3;
+const uint16_t LOG_SIZE = LOG_RECORDS*LOG_RECORD_SIZE;
+const uint16_t LOG_CHECKPOINT = 0x3FF; // record address marking a checkpoint
+const uint8_t LOG_CLEAN_STEP = 2; // entries folded home per loop() iteration
+
+bool logMode = false;
+uint16_t logStart;
+uint8_t logHead = 0; // slot of the next record
+uint8_t logSeq = 1; // sequence number of the next record
+uint8_t logPending = 0; // records written since the last checkpoint
+
+// In-RAM view of the log tail, latest value per address
+uint16_t logAddr[LOG_RECORDS];
+uint8_t logValue[LOG_RECORDS];
+uint32_t logDirty = 0; // bit set if the entry was not folded home yet
+uint8_t logEntries = 0;
+
 /*
 void flushBuffer() {
   for (uint8_t i = 0; i < writeBufferPointer; i++) {
@@ -69,16 +133,166 @@ uint8_t readROM(uint16_t address) {
   return EEPROM.read(address);
 }*/
 
-/* Non buffered EEPROM rd-write */
+/* Physically write a byte if it changed, counting EEPROM write cycles.
+Return whether the byte was written */
+bool updateROM(uint16_t address, uint8_t value) {
+  if (EEPROM.read(address) != value) {
+    EEPROM.write(address, value);
+    totalWriteCycles++;
+    return true;
+  }
+  return false;
+}
+
+/* Return the log view entry for address, -1 if there is none */
+int8_t logFind(uint16_t address) {
+  for (uint8_t i = 0; i < logEntries; i++) {
+    if (logAddr[i] == address) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Update the in-RAM log view */
+void logRemember(uint16_t address, uint8_t value) {
+  int8_t i = logFind(address);
+  if (i < 0) {
+    i = logEntries++;
+    logAddr[i] = address;
+  }
+  logValue[i] = value;
+  bitSet(logDirty, i);
+}
+
+uint8_t nextLogSeq(uint8_t seq) {
+  return seq == 63 ? 1 : seq+1;
+}
+
+uint8_t logRecordSeq(uint8_t slot) {
+  return EEPROM.read(logStart+slot*LOG_RECORD_SIZE) >> 2;
+}
+
+uint16_t logRecordAddr(uint8_t slot) {
+  uint16_t recordAddr = logStart+slot*LOG_RECORD_SIZE;
+  return (EEPROM.read(recordAddr) & 0b11)*256+EEPROM.read(recordAddr+1);
+}
+
+/* Append a record to the circular log, the sequence byte is written last */
+void writeLogRecord(uint16_t address, uint8_t value) {
+  uint16_t recordAddr = logStart+logHead*LOG_RECORD_SIZE;
+  updateROM(recordAddr+1, lowByte(address));
+  updateROM(recordAddr+2, value);
+  updateROM(recordAddr, logSeq << 2 | highByte(address));
+  logHead = (logHead+1)%LOG_RECORDS;
+  logSeq = nextLogSeq(logSeq);
+}
+
+/* Fold up to maxEntries log entries back to their home addresses and write a
+checkpoint once all are folded. Return whether the log is clean */
+bool cleanLog(uint8_t maxEntries) {
+  for (uint8_t i = 0; i < logEntries && maxEntries > 0; i++) {
+    if (bitRead(logDirty, i)) {
+      if (updateROM(logAddr[i], logValue[i])) {
+        metaWriteCycles++;
+      }
+      bitClear(logDirty, i);
+      maxEntries--;
+    }
+  }
+  if (logDirty) {
+    return false;
+  }
+  if (logPending > 0) {
+    writeLogRecord(LOG_CHECKPOINT, 0);
+    logPending = 0;
+    logEntries = 0;
+  }
+  return true;
+}
+
+/* Append an update to the log, checkpointing first if the log is full */
+void logAppend(uint16_t address, uint8_t value) {
+  if (logPending >= LOG_RECORDS-1) {
+    cleanLog(LOG_RECORDS);
+  }
+  writeLogRecord(address, value);
+  logPending++;
+  logRemember(address, value);
+}
+
+/* Rebuild the in-RAM log view from the latest checkpoint plus the log tail */
+void replayLog() {
+  logEntries = 0;
+  logDirty = 0;
+  logPending = 0;
+  logHead = 0;
+  logSeq = 1;
+
+  // the latest record is the one not followed by its successor sequence number
+  int16_t latest = -1;
+  for (uint8_t i = 0; i < LOG_RECORDS; i++) {
+    uint8_t seq = logRecordSeq(i);
+    if (seq != 0 && logRecordSeq((i+1)%LOG_RECORDS) != nextLogSeq(seq)) {
+      latest = i;
+      break;
+    }
+  }
+  if (latest < 0) {
+    return;
+  }
+  logHead = (latest+1)%LOG_RECORDS;
+  logSeq = nextLogSeq(logRecordSeq(latest));
+
+  // count records back to the latest checkpoint
+  uint8_t i = latest;
+  while (logPending < LOG_RECORDS && logRecordAddr(i) != LOG_CHECKPOINT) {
+    logPending++;
+    uint8_t prev = (i+LOG_RECORDS-1)%LOG_RECORDS;
+    if (logRecordSeq(prev) == 0 || nextLogSeq(logRecordSeq(prev)) != logRecordSeq(i)) {
+      break;
+    }
+    i = prev;
+  }
+
+  // replay oldest first so the latest value wins
+  for (uint8_t k = logPending; k > 0; k--) {
+    uint8_t slot = (latest+1+LOG_RECORDS-k)%LOG_RECORDS;
+    logRemember(logRecordAddr(slot), EEPROM.read(logStart+slot*LOG_RECORD_SIZE+2));
+  }
+}
+
+/* EEPROM write; addresses with pending log entries keep going through the log */
 void writeROM(uint16_t address, uint8_t value) {
-  EEPROM.update(address, value);
+  if (logMode && logFind(address) >= 0) {
+    logAppend(address, value);
+    return;
+  }
+  updateROM(address, value);
 }
 
-/* Non buffered EEPROM read */
+/* EEPROM read through the in-RAM log view */
 uint8_t readROM(uint16_t address) {
+  if (logMode) {
+    int8_t i = logFind(address);
+    if (i >= 0) {
+      return logValue[i];
+    }
+  }
   return EEPROM.read(address);
 }
 
+/* Write frequently updated fs metadata (dir tables, sizes, root pointer, refcounts) */
+void writeMeta(uint16_t address, uint8_t value) {
+  if (!logMode) {
+    if (updateROM(address, value)) {
+      metaWriteCycles++;
+    }
+  } else if (readROM(address) != value) {
+    logAppend(address, value);
+  }
+}
+
 /* Read two sequential bytes as uint16_t */
 uint16_t readTwoBytes(uint16_t addr) {
   return readROM(addr)*pow(2, 8)+readROM(addr+1);
@@ -86,11 +300,21 @@ uint16_t readTwoBytes(uint16_t addr) {
 
 /* Write uint16_t as two sequential bytes */
 void writeTwoBytes(uint16_t addr, uint16_t value) {
-  writeROM(addr, highByte(value));
-  writeROM(addr+1, lowByte(value));
+  writeMeta(addr, highByte(value));
+  writeMeta(addr+1, lowByte(value));
+}
+
+/* Forget the log view, e.g. when the fs is overwritten */
+void resetLog() {
+  logMode = false;
+  logEntries = 0;
+  logDirty = 0;
+  logPending = 0;
 }
 
 void wipe() {
+  resetLog();
+  fsMounted = false;
   for (uint16_t i = 0; i < EEPROM.length(); i++) {
     writeROM(i, 0);
   }
@@ -116,13 +340,145 @@ void memdump(bool direct) {
   Serial.println();
 }
 
+/* Map a char to its 6 bit code (0-9, A-Z, a-z, '.', '_'), return -1 if it has none */
+int8_t packCode(char c) {
+  if (c >= '0' && c <= '9') return c-'0';
+  if (c >= 'A' && c <= 'Z') return c-'A'+10;
+  if (c >= 'a' && c <= 'z') return c-'a'+36;
+  if (c == '.') return 62;
+  if (c == '_') return 63;
+  return -1;
+}
+
+char unpackCode(uint8_t code) {
+  if (code < 10) return '0'+code;
+  if (code < 36) return 'A'+code-10;
+  if (code < 62) return 'a'+code-36;
+  return code == 62 ? '.' : '_';
+}
+
+/* Number of bytes needed to store n 6 bit codes */
+uint8_t packedSize(uint8_t n) {
+  return ((uint16_t) n*6+7)/8;
+}
+
+/* Read the i-th 6 bit code of a packed sequence starting at addr */
+uint8_t readPacked(uint16_t addr, uint8_t i) {
+  uint16_t bit = (uint16_t) i*6;
+  uint16_t word = readROM(addr+bit/8) << 8;
+  if (bit%8 > 2) {
+    word |= readROM(addr+bit/8+1);
+  }
+  return (word >> (10-bit%8)) & 0x3F;
+}
+
+/* Store the i-th 6 bit code of a packed sequence in a zeroed buffer */
+void writePacked(byte *buffer, uint8_t i, uint8_t code) {
+  uint16_t bit = (uint16_t) i*6;
+  uint16_t word = (uint16_t) code << (10-bit%8);
+  buffer[bit/8] |= highByte(word);
+  if (bit%8 > 2) {
+    buffer[bit/8+1] |= lowByte(word);
+  }
+}
+
+/* Run length encode data into out (if not NULL), return the encoded size.
+Control byte c < 0x80: c+1 literal bytes follow, c >= 0x80: next byte repeats c-0x80+3 times */
+uint16_t rleEncode(byte *data, uint8_t dataSize, byte *out) {
+  uint16_t outSize = 0;
+  uint8_t i = 0;
+  while (i < dataSize) {
+    uint8_t run = 1;
+    while (i+run < dataSize && data[i+run] == data[i] && run < 130) {
+      run++;
+    }
+    if (run >= 3) {
+      if (out) {out[outSize] = 0x80+run-3; out[outSize+1] = data[i];}
+      outSize += 2;
+      i += run;
+      continue;
+    }
+
+    // collect literals until the next run of 3 or more
+    uint8_t literals = 0;
+    while (i+literals < dataSize && literals < 128) {
+      if (i+literals+2 < dataSize && data[i+literals] == data[i+literals+1] && data[i+literals] == data[i+literals+2]) {
+        break;
+      }
+      literals++;
+    }
+    if (out) {
+      out[outSize] = literals-1;
+      memcpy(out+outSize+1, data+i, literals);
+    }
+    outSize += 1+literals;
+    i += literals;
+  }
+  return outSize;
+}
+
+/* Encode data in place with the smallest encoding, return the new size and
+set the matching header flags. Data is kept raw if no encoding saves space */
+uint8_t encodeData(byte *data, uint8_t dataSize, byte *header) {
+  bool packable = true;
+  for (uint8_t i = 0; i < dataSize; i++) {
+    if (packCode(data[i]) < 0) {
+      packable = false;
+      break;
+    }
+  }
+  uint16_t packedLength = packable ? 1+packedSize(dataSize) : 0xFFFF;
+  uint16_t rleLength = 1+rleEncode(data, dataSize, NULL);
+
+  if (packedLength >= dataSize && rleLength >= dataSize) {
+    return dataSize;
+  }
+
+  byte encoded[dataSize];
+  memset(encoded, 0, dataSize);
+  encoded[0] = dataSize;
+  uint8_t encodedSize;
+  if (packedLength <= rleLength) {
+    for (uint8_t i = 0; i < dataSize; i++) {
+      writePacked(encoded+1, i, packCode(data[i]));
+    }
+    encodedSize = packedLength;
+    bitSet(*header, HDR_PACKED_DATA);
+  } else {
+    rleEncode(data, dataSize, encoded+1);
+    encodedSize = rleLength;
+    bitSet(*header, HDR_RLE_DATA);
+  }
+  memcpy(data, encoded, encodedSize);
+  return encodedSize;
+}
+
+/* Return whether a name is stored as 6 bit codes */
+bool packName(String name) {
+  for (uint8_t i = 0; i < name.length(); i++) {
+    if (packCode(name.charAt(i)) < 0) {
+      return false;
+    }
+  }
+  return packedSize(name.length()) < name.length();
+}
+
+/* Number of bytes the file's name occupies in its record */
+uint8_t storedNameSize(struct File f) {
+  if (bitRead(f.header, HDR_PACKED_NAME)) {
+    return packedSize(f.name.length());
+  }
+  return f.name.length();
+}
+
 /* Read and return file starting at addr */
 struct File readFile(uint16_t addr) {
   struct File file;
   file.address = addr;
 
   uint8_t header = readROM(addr);
-  file.isDir = bitRead(header, 0);
+  file.header = header;
+  file.isDir = bitRead(header, HDR_DIR);
 
   uint8_t nameSize = readROM(addr+1);
   uint8_t dataSize = readROM(addr+2);
@@ -130,14 +486,101 @@ struct File readFile(uint16_t addr) {
 
   String name;
   for (uint8_t i = 0; i < nameSize; i++) {
-    name += char(readROM(addr+3+i));
+    if (bitRead(header, HDR_PACKED_NAME)) {
+      name += unpackCode(readPacked(addr+3, i));
+    } else {
+      name += char(readROM(addr+3+i));
+    }
   }
   file.name = name;
 
-  file.dataStartAddr = addr+3+nameSize;
+  file.dataStartAddr = addr+3+storedNameSize(file);
+  file.extentAddr = 0;
+
+  // Resolve shared data so readers see the extent content transparently
+  if (bitRead(header, HDR_SHARED)) {
+    file.extentAddr = readTwoBytes(file.dataStartAddr);
+    file.dataSize = readROM(file.extentAddr+1);
+    file.dataStartAddr = file.extentAddr+EXTENT_HEADER_SIZE;
+  }
   return file;
 }
 
+/* Return the address following the last byte of the file's own record */
+uint16_t recordEnd(struct File f) {
+  uint16_t end = f.dataStartAddr+f.dataSize;
+  if (f.extentAddr) {
+    end = f.address+3+storedNameSize(f)+2;
+  }
+  return end+bitRead(f.header, HDR_CRC);
+}
+
+/* CRC8 (poly 0x07) over header flags, name and data. The shared flag is left
+out so that moving data into a shared extent keeps the checksum valid */
+uint8_t fileCrc(struct File f) {
+  uint8_t crc = 0;
+  uint16_t nameAddr = f.address+3;
+  uint16_t length = 3+storedNameSize(f)+f.dataSize;
+  for (uint16_t i = 0; i < length; i++) {
+    byte value;
+    if (i == 0) {
+      value = f.header & ~(1<<HDR_SHARED);
+    } else if (i == 1) {
+      value = f.name.length();
+    } else if (i == 2) {
+      value = f.dataSize;
+    } else if (i < 3+storedNameSize(f)) {
+      value = readROM(nameAddr+i-3);
+    } else {
+      value = readROM(f.dataStartAddr+i-3-storedNameSize(f));
+    }
+    crc ^= value;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+/* Return the decoded data length (packed and RLE data store it in their first byte) */
+uint8_t dataLength(struct File f) {
+  if (f.header & DATA_ENCODING_MASK) {
+    return readROM(f.dataStartAddr);
+  }
+  return f.dataSize;
+}
+
+/* Decode file data on the fly and print it to serial */
+void printData(struct File f) {
+  uint16_t addr = f.dataStartAddr;
+  uint16_t end = f.dataStartAddr+f.dataSize;
+  if (bitRead(f.header, HDR_PACKED_DATA)) {
+    uint8_t length = readROM(addr);
+    for (uint8_t i = 0; i < length; i++) {
+      Serial.print(unpackCode(readPacked(addr+1, i)));
+    }
+  } else if (bitRead(f.header, HDR_RLE_DATA)) {
+    addr++;
+    while (addr < end) {
+      uint8_t control = readROM(addr++);
+      if (control < 0x80) {
+        for (uint8_t i = 0; i <= control; i++) {
+          Serial.print(char(readROM(addr++)));
+        }
+      } else {
+        char value = readROM(addr++);
+        for (uint8_t i = 0; i < control-0x80+3; i++) {
+          Serial.print(value);
+        }
+      }
+    }
+  } else {
+    for (; addr < end; addr++) {
+      Serial.print(char(readROM(addr)));
+    }
+  }
+}
+
 /* Read all subdirectories and files in a dir */
 void getSubfiles(struct File f, struct File *result) {
   if (!f.isDir) {
@@ -166,31 +609,82 @@ void ls() {
   for (uint8_t i = 0; i < sizeof(subfiles)/sizeof(struct File); i++) {
     Serial.print(subfiles[i].isDir); Serial.print('\t');
     Serial.print(subfiles[i].address); Serial.print('\t');
-    Serial.print(subfiles[i].dataSize); Serial.print('\t');
+    Serial.print(dataLength(subfiles[i])); Serial.print('\t');
     Serial.println(subfiles[i].name);
   }
 }
 
+/* Find a file by name in dir, reading one entry at a time */
+struct File findInDir(struct File dir, String name) {
+  struct File f;
+  for (uint16_t i = dir.dataStartAddr; i < dir.dataStartAddr+dir.dataSize; i+=2) {
+    f = readFile(readTwoBytes(i));
+    if (f.name == name) {
+      return f;
+    }
+  }
+  f.name = F("ERR_FILE_NOT_FOUND");
+  return f;
+}
+
 struct File getFileByName(String name) {
-  struct File currentCwd = cwd[cwdPointer];
-  struct File subfiles[currentCwd.dataSize/2];
-  getSubfiles(currentCwd, subfiles);
+  return findInDir(cwd[cwdPointer], name);
+}
 
-  struct File f;
-  bool foundDir = false;
-  for (uint8_t i = 0; i < sizeof(subfiles)/sizeof(struct File); i++) {
-    if (subfiles[i].name == name) {
-      f = subfiles[i];
-      foundDir = true;
-      break;
+const uint8_t PATH_DEPTH = sizeof(cwd)/sizeof(struct File);
+
+/* Resolve a '/' separated path, from root if it starts with '/', else from cwd.
+"." and empty parts stay in place, ".." moves up (never above root). Store the
+addresses from root down to the file in chain (PATH_DEPTH entries), return how
+many were stored or 0 if the path can't be resolved */
+uint8_t resolvePath(String path, uint16_t *chain) {
+  uint8_t levels = 1;
+  chain[0] = cwd[0].address;
+  if (path.charAt(0) != '/') {
+    for (; levels <= cwdPointer; levels++) {
+      chain[levels] = cwd[levels].address;
     }
   }
-  if (!foundDir) {
-    f.name = F("ERR_FILE_NOT_FOUND");
+  struct File f = readFile(chain[levels-1]);
+  uint16_t start = 0;
+  while (start < path.length()) {
+    int16_t end = path.indexOf('/', start);
+    if (end < 0) {
+      end = path.length();
+    }
+    String part = path.substring(start, end);
+    if (part == "..") {
+      if (levels > 1) {
+        levels--;
+        f = readFile(chain[levels-1]);
+      }
+    } else if (part.length() > 0 && part != ".") {
+      if (!f.isDir) {
+        Serial.println(F("Error: Not a directory."));
+        return 0;
+      }
+      f = findInDir(f, part);
+      if (f.name == F("ERR_FILE_NOT_FOUND")) {
+        Serial.println(F("Error: File not found"));
+        return 0;
+      }
+      if (levels >= PATH_DEPTH) {
+        Serial.println(F("Error: Path nested too deeply."));
+        return 0;
+      }
+      chain[levels++] = f.address;
+    }
+    start = end+1;
   }
-  return f;
+  return levels;
 }
 
+/* Print the names of the files in a resolved path chain, each followed by '/' */
+void printChain(uint16_t *chain, uint8_t levels) {
+  for (uint8_t i = 0; i < levels; i++) {
+    Serial.print(readFile(chain[i]).name); Serial.print('/');
+  }
+}
 
 /* Set memory address alloc state, optionally wipe address on dealloc */
 void setAllocMapPos(uint16_t addr, bool value, bool wipeOnDealloc) {
@@ -217,6 +711,18 @@ void dumpAllocMap() {
   Serial.println();
 }
 
+/* Drop one reference to a shared extent, free it once unreferenced */
+void releaseExtent(uint16_t extentAddr, bool wipeOnDealloc) {
+  uint8_t refCount = readROM(extentAddr);
+  if (refCount > 1) {
+    writeMeta(extentAddr, refCount-1);
+    return;
+  }
+  for (uint16_t i = extentAddr; i < extentAddr+EXTENT_HEADER_SIZE+readROM(extentAddr+1); i++) {
+    setAllocMapPos(i, 0, wipeOnDealloc);
+  }
+}
+
 /* Recursively set alloc state for file(s) */
 void markInAllocMap(struct File f, bool value, bool wipeOnDealloc) {
   if (f.isDir) {
@@ -230,27 +736,536 @@ void markInAllocMap(struct File f, bool value, bool wipeOnDealloc) {
   }
 
   // Set this file in allocation map
-  for (uint16_t i = f.address; i < f.dataStartAddr+f.dataSize; i++) {
+  for (uint16_t i = f.address; i < recordEnd(f); i++) {
     setAllocMapPos(i, value, wipeOnDealloc);
   }
+
+  // Shared extents stay allocated as long as any file references them
+  if (f.extentAddr) {
+    if (value) {
+      for (uint16_t i = f.extentAddr; i < f.dataStartAddr+f.dataSize; i++) {
+        setAllocMapPos(i, 1, false);
+      }
+    } else {
+      releaseExtent(f.extentAddr, wipeOnDealloc);
+    }
+  }
 }
 
-/* Recreate alloc map from filesystem */
-void createAllocMap() {
-  // reset alloc map
-  for (uint16_t i = 0; i < EEPROM.length(); i++) {
-    setAllocMapPos(i, 0, false);
+/* Call visit for every file below dir (depth first), reading one entry at a time */
+void walkTree(struct File dir, void (*visit)(struct File)) {
+  for (uint16_t i = dir.dataStartAddr; i < dir.dataStartAddr+dir.dataSize; i+=2) {
+    struct File f = readFile(readTwoBytes(i));
+    visit(f);
+    if (f.isDir) {
+      walkTree(f, visit);
+    }
+  }
+}
+
+/* End of the area file records and extents may occupy */
+uint16_t fsDataEnd() {
+  return logMode ? logStart : fs_size-1;
+}
+
+const uint8_t WALK_FILE = 0; // next entry read into f
+const uint8_t WALK_BAD_ENTRY = 1; // entry of the top dir points out of bounds
+const uint8_t WALK_DIR_DONE = 2; // dir exhausted and popped, its address is still at dir[depth]
+const uint8_t WALK_END = 3;
+
+/* Start a walk below dir */
+void walkStart(struct TreeWalk *w, struct File dir) {
+  w->dir[0] = dir.address;
+  w->index[0] = 0;
+  w->depth = 1;
+}
+
+/* Descend into dir on the next step, return false if the stack is full */
+bool walkPush(struct TreeWalk *w, struct File dir) {
+  if (w->depth >= WALK_DEPTH) {
+    return false;
+  }
+  w->dir[w->depth] = dir.address;
+  w->index[w->depth] = 0;
+  w->depth++;
+  return true;
+}
+
+/* Advance the walk by one entry of the top dir. Dirs are not entered unless
+the caller pushes them */
+uint8_t walkNext(struct TreeWalk *w, struct File *f) {
+  if (w->depth == 0) {
+    return WALK_END;
+  }
+  struct File dir = readFile(w->dir[w->depth-1]);
+  if (w->index[w->depth-1]*2 >= dir.dataSize) {
+    w->depth--;
+    return WALK_DIR_DONE;
+  }
+  uint16_t addr = readTwoBytes(dir.dataStartAddr+w->index[w->depth-1]*2);
+  w->index[w->depth-1]++;
+  if (addr < HEADER_SIZE || addr >= fsDataEnd()) {
+    return WALK_BAD_ENTRY;
+  }
+  *f = readFile(addr);
+  return WALK_FILE;
+}
+
+/* Print the names of the dirs on the walk stack from level 1 up to levels-1 */
+void printWalkPath(struct TreeWalk *w, uint8_t levels) {
+  for (uint8_t i = 1; i < levels; i++) {
+    Serial.print(readFile(w->dir[i]).name); Serial.print('/');
+  }
+}
+
+/* Check a file record for structural problems (bounds, name, extent, dir header
+and size, crc), return the problem found or NULL */
+const __FlashStringHelper *fileProblem(struct File f) {
+  uint16_t fsEnd = fsDataEnd();
+  if (f.address < HEADER_SIZE || recordEnd(f) > fsEnd) {
+    return F("record out of bounds");
+  }
+  if (f.name.length() == 0) {
+    return F("empty name");
+  }
+  for (uint8_t i = 0; i < f.name.length(); i++) {
+    if (f.name.charAt(i) <= ' ' || f.name.charAt(i) > '~') {
+      return F("invalid name");
+    }
+  }
+  if (f.extentAddr && (f.extentAddr < HEADER_SIZE || f.dataStartAddr+f.dataSize > fsEnd)) {
+    return F("broken shared extent");
+  }
+  // dir tables are never shared, encoded or checksummed
+  if (f.isDir && (f.header & (1<<HDR_SHARED | DATA_ENCODING_MASK | 1<<HDR_CRC))) {
+    return F("invalid directory header");
+  }
+  if (f.isDir && f.dataSize%2 != 0) {
+    return F("odd directory size");
+  }
+  if (bitRead(f.header, HDR_CRC) && readROM(recordEnd(f)-1) != fileCrc(f)) {
+    return F("crc mismatch");
   }
+  return NULL;
+}
+
+void printFileProblem(struct File f, const __FlashStringHelper *problem) {
+  Serial.print(F("Error: File ")); Serial.print(f.address); Serial.print(':'); Serial.print(f.name);
+  Serial.print(F(": ")); Serial.println(problem);
+}
+
+/* Check a file record against the fs bounds, the allocation map and its crc.
+Optionally print the first problem found, return whether the file is consistent */
+bool verifyFile(struct File f, bool report) {
+  const __FlashStringHelper *problem = fileProblem(f);
+  if (problem == NULL) {
+    for (uint16_t i = f.address; i < recordEnd(f); i++) {
+      if (!getAllocMapPos(i)) {
+        problem = F("record not allocated");
+        break;
+      }
+    }
+  }
+
+  if (problem && report) {
+    printFileProblem(f, problem);
+  }
+  return problem == NULL;
+}
+
+/* Restart the incremental scrub, e.g. after directories were moved */
+void resetScrub() {
+  scrubWalk.depth = 0;
+  scrubPassErrors = 0;
+}
+
+uint16_t checkedFiles;
+uint16_t checkErrors;
+bool checkReport;
+// fsck repair runs rounds of passes until nothing changes: a scan pass marks
+// bytes claimed by more than one record, then entries with broken records are
+// unlinked from directories that own their bytes alone. Once no broken entries
+// are left, the first record found overlapping an earlier one is unlinked
+uint8_t checkRepair = 0;
+const uint8_t REPAIR_SCAN = 1;
+const uint8_t REPAIR_BROKEN = 2;
+const uint8_t REPAIR_OVERLAP = 3;
+byte *checkContested;
+bool checkChanged;
+
+// references counted per shared extent, compared with the stored refcounts
+const uint8_t CHECK_EXTENTS = 16;
+uint16_t checkExtentAddr[CHECK_EXTENTS];
+uint8_t checkExtentRefs[CHECK_EXTENTS];
+uint8_t checkExtents;
+bool checkExtentsFull;
+uint16_t checkRefcountErrors;
+
+void checkFailed(struct File f, const __FlashStringHelper *problem) {
+  checkErrors++;
+  if (checkReport) {
+    printFileProblem(f, problem);
+  }
+}
+
+/* Claim bytes [start, end) in an ownership bitmap, return false if any of them
+lies outside the file area or was claimed before */
+bool claimRange(byte *owned, uint16_t start, uint16_t end) {
+  if (start < HEADER_SIZE || end > fsDataEnd() || end < start) {
+    return false;
+  }
+  bool unclaimed = true;
+  for (uint16_t i = start; i < end; i++) {
+    if (bitRead(owned[i/8], 7-i%8)) {
+      unclaimed = false;
+      if (checkRepair == REPAIR_SCAN) {
+        bitSet(checkContested[i/8], 7-i%8);
+      }
+    }
+    bitSet(owned[i/8], 7-i%8);
+  }
+  return unclaimed;
+}
+
+/* Count a reference to a shared extent */
+void countReference(uint16_t extentAddr) {
+  for (uint8_t i = 0; i < checkExtents; i++) {
+    if (checkExtentAddr[i] == extentAddr) {
+      if (checkExtentRefs[i] < 0xFF) {
+        checkExtentRefs[i]++;
+      }
+      return;
+    }
+  }
+  if (checkExtents == CHECK_EXTENTS) {
+    checkExtentsFull = true;
+    return;
+  }
+  checkExtentAddr[checkExtents] = extentAddr;
+  checkExtentRefs[checkExtents] = 1;
+  checkExtents++;
+}
+
+/* Claim the in-bounds bytes of a file record and its shared extent, return false
+if some of them were claimed before. Broken records are claimed as well, so the
+allocator never hands out bytes a reachable record may still be using */
+bool claimFile(struct File f, byte *owned) {
+  uint16_t fsEnd = fsDataEnd();
+  bool unclaimed = claimRange(owned, f.address, min(recordEnd(f), fsEnd));
+  if (f.extentAddr >= HEADER_SIZE && f.extentAddr < fsEnd) {
+    uint16_t extentEnd = min((uint16_t) (f.dataStartAddr+f.dataSize), fsEnd);
+    // every reference after the first finds the extent fully claimed already
+    bool claimed = true;
+    for (uint16_t i = f.extentAddr; i < extentEnd; i++) {
+      if (!bitRead(owned[i/8], 7-i%8)) {
+        claimed = false;
+        break;
+      }
+    }
+    if (!claimed && !claimRange(owned, f.extentAddr, extentEnd)) {
+      unclaimed = false;
+    }
+    countReference(f.extentAddr);
+  }
+  return unclaimed;
+}
+
+/* Check a file and claim its bytes, return false if it overlaps bytes claimed before */
+bool checkFile(struct File f, byte *owned) {
+  const __FlashStringHelper *problem = fileProblem(f);
+  bool unclaimed = claimFile(f, owned);
+  if (!unclaimed && problem == NULL) {
+    problem = F("record overlaps another record");
+  }
+  if (problem) {
+    checkFailed(f, problem);
+  }
+  return unclaimed;
+}
+
+/* fsck repair: return whether none of the bytes [start, end) is claimed twice */
+bool uncontested(uint16_t start, uint16_t end) {
+  if (end > fsDataEnd() || end < start) {
+    return false;
+  }
+  for (uint16_t i = start; i < end; i++) {
+    if (bitRead(checkContested[i/8], 7-i%8)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* fsck repair: shrink an odd sized directory table, or one whose end overlaps
+another record (a wrong size byte being the likely cause), to an even size
+ending before the overlap. Only done if the dir's header and name are its own */
+void repairDir(struct File *dir) {
+  if (checkRepair != REPAIR_BROKEN || !dir->isDir || !uncontested(dir->address, dir->dataStartAddr)) {
+    return;
+  }
+  uint8_t size = 0;
+  uint16_t entryAddr = dir->dataStartAddr;
+  while (size+2 <= dir->dataSize && entryAddr+size+2 <= fsDataEnd() && uncontested(entryAddr+size, entryAddr+size+2)) {
+    size += 2;
+  }
+  if (size == dir->dataSize) {
+    return;
+  }
+  Serial.print(F("Truncated ")); Serial.print(dir->address); Serial.print(':'); Serial.print(dir->name);
+  Serial.print(F(" from ")); Serial.print(dir->dataSize); Serial.print(F(" to ")); Serial.print(size); Serial.println(F(" bytes."));
+  dir->dataSize = size;
+  writeMeta(dir->address+2, size);
+  checkChanged = true;
+}
+
+/* fsck repair: remove entry i from a directory table, the last entry takes its place */
+struct File unlinkEntry(struct File dir, uint8_t i) {
+  uint16_t entryAddr = dir.dataStartAddr+i*2;
+  Serial.print(F("Unlinked ")); Serial.print(readTwoBytes(entryAddr));
+  Serial.print(F(" from ")); Serial.print(dir.address); Serial.print(':'); Serial.println(dir.name);
+  dir.dataSize -= 2;
+  writeTwoBytes(entryAddr, readTwoBytes(dir.dataStartAddr+dir.dataSize));
+  writeMeta(dir.address+2, dir.dataSize);
+  checkChanged = true;
+  return dir;
+}
+
+/* Return whether a directory holds its own table within the file area */
+bool tableInBounds(struct File dir) {
+  return !dir.extentAddr && dir.dataStartAddr+dir.dataSize <= fsDataEnd();
+}
+
+/* Recursively check all files below dir. Broken dirs are still followed, only
+records claimed before are not, which stops directory cycles. In repair mode bad
+entries are unlinked from dir */
+void _checkDir(struct File dir, byte *owned, uint8_t depth) {
+  // broken entries are only unlinked from dirs that own all of their bytes, one
+  // sharing bytes with other records may be garbage
+  bool canRepair = checkRepair >= REPAIR_BROKEN && tableInBounds(dir);
+  if (checkRepair == REPAIR_BROKEN) {
+    canRepair = canRepair && uncontested(dir.address, recordEnd(dir));
+  }
+  uint8_t i = 0;
+  while (i*2 < dir.dataSize) {
+    uint16_t addr = readTwoBytes(dir.dataStartAddr+i*2);
+    checkedFiles++;
+    bool unlink = false;
+    if (addr < HEADER_SIZE || addr >= fsDataEnd()) {
+      checkFailed(dir, F("directory entry out of bounds"));
+      unlink = canRepair && checkRepair == REPAIR_BROKEN;
+    } else {
+      struct File f = readFile(addr);
+      bool firstVisit = !bitRead(owned[addr/8], 7-addr%8);
+      repairDir(&f);
+      unlink = canRepair && checkRepair == REPAIR_BROKEN && fileProblem(f) != NULL;
+      // the record reached first wins an overlap. Its parent was claimed before
+      // without overlapping, so the table written is not shared with others
+      if (!unlink && !checkFile(f, owned)) {
+        unlink = canRepair && checkRepair == REPAIR_OVERLAP && !checkChanged;
+      }
+      if (!unlink && f.isDir && firstVisit && tableInBounds(f)) {
+        if (depth < sizeof(cwd)/sizeof(struct File)) {
+          _checkDir(f, owned, depth+1);
+        } else {
+          checkFailed(f, F("directory nested too deeply"));
+        }
+      }
+    }
+    if (unlink) {
+      dir = unlinkEntry(dir, i);
+    } else {
+      i++;
+    }
+  }
+}
+
+/* Walk the tree and build a bitmap of the bytes owned by the fs header, the
+log, file records and shared extents. Return whether no problems were found */
+bool checkTree(byte *owned, bool report) {
+  memset(owned, 0, sizeof(allocMap));
+  checkedFiles = 1;
+  checkErrors = 0;
+  checkReport = report;
+  checkExtents = 0;
+  checkExtentsFull = false;
+  checkRefcountErrors = 0;
 
-  // Add filesystem header to allocation map
   for (uint8_t i = 0; i < HEADER_SIZE; i++) {
-    setAllocMapPos(i, 1, false);
+    bitSet(owned[i/8], 7-i%8);
+  }
+  for (uint16_t i = fsDataEnd(); i < fs_size; i++) {
+    bitSet(owned[i/8], 7-i%8);
+  }
+
+  // a repair pass may have changed the root table
+  cwd[0] = readFile(cwd[0].address);
+  if (!cwd[0].isDir) {
+    checkFailed(cwd[0], F("root is not a directory"));
+    claimFile(cwd[0], owned);
+  } else {
+    repairDir(&cwd[0]);
+    checkFile(cwd[0], owned);
+    if (tableInBounds(cwd[0])) {
+      _checkDir(cwd[0], owned, 1);
+    }
+  }
+
+  for (uint8_t i = 0; i < checkExtents; i++) {
+    uint8_t refCount = readROM(checkExtentAddr[i]);
+    if (refCount != checkExtentRefs[i]) {
+      checkRefcountErrors++;
+      if (report) {
+        Serial.print(F("Error: Shared extent ")); Serial.print(checkExtentAddr[i]); Serial.print(F(": refcount "));
+        Serial.print(refCount); Serial.print(F(", ")); Serial.print(checkExtentRefs[i]); Serial.println(F(" references"));
+      }
+    }
   }
+  if (checkExtentsFull && report) {
+    Serial.print(F("Warning: Refcounts of shared extents beyond the first ")); Serial.print(CHECK_EXTENTS); Serial.println(F(" were not verified."));
+  }
+  return checkErrors == 0;
+}
+
+/* Set the refcounts of the extents seen by the last checkTree to the references counted */
+void fixRefcounts() {
+  for (uint8_t i = 0; i < checkExtents; i++) {
+    writeMeta(checkExtentAddr[i], checkExtentRefs[i]);
+  }
+}
+
+/* fsck repair, see checkRepair. Every round unlinks or truncates something, so
+the tree shrinks until a round changes nothing */
+void repairTree(byte *owned) {
+  byte contested[sizeof(allocMap)];
+  checkContested = contested;
+  bool report = true;
+  do {
+    checkChanged = false;
+    memset(contested, 0, sizeof(contested));
+    checkRepair = REPAIR_SCAN;
+    checkTree(owned, report);
+    report = false;
+    checkRepair = REPAIR_BROKEN;
+    checkTree(owned, false);
+    if (!checkChanged) {
+      checkRepair = REPAIR_OVERLAP;
+      checkTree(owned, false);
+    }
+  } while (checkChanged);
+  checkRepair = 0;
+  // directories on the cwd path may have been unlinked
+  cwdPointer = 0;
+  resetScrub();
+}
+
+/* Recreate alloc map from filesystem. Every reachable record stays allocated,
+even a broken one, return whether the tree and all refcounts are consistent */
+bool createAllocMap() {
+  return checkTree(allocMap, false) && checkRefcountErrors == 0;
+}
 
-  // Add filesystem terminator to allocation map
-  setAllocMapPos(fs_size-1, 1, false);
-  // Recursively mark all files as allocated.
-  markInAllocMap(cwd[0], 1, false);
+/* Refuse to change an inconsistent tree: freeing a broken record could release
+bytes that belong to other files */
+bool checkWritable() {
+  if (fsNeedsCheck) {
+    Serial.println(F("Error: Filesystem is inconsistent, run fsck first"));
+    return false;
+  }
+  return true;
+}
+
+/* Check tree and allocation map consistency, rebuild the allocation map if the
+tree is intact. With repair, bad entries are unlinked from their directories first */
+void fsck(bool repair) {
+  byte owned[sizeof(allocMap)];
+  if (repair) {
+    repairTree(owned);
+  }
+  bool consistent = checkTree(owned, true);
+
+  uint16_t leaked = 0;
+  uint16_t unallocated = 0;
+  for (uint16_t i = 0; i < EEPROM.length(); i++) {
+    bool allocated = getAllocMapPos(i);
+    bool inUse = bitRead(owned[i/8], 7-i%8);
+    leaked += allocated && !inUse;
+    unallocated += inUse && !allocated;
+  }
+
+  Serial.print(F("Checked ")); Serial.print(checkedFiles); Serial.print(F(" files, ")); Serial.print(checkErrors); Serial.println(F(" errors."));
+  if (checkRefcountErrors > 0) {
+    Serial.print(checkRefcountErrors); Serial.println(F(" shared extents have a wrong refcount."));
+  }
+  if (leaked > 0) {
+    Serial.print(leaked); Serial.println(F(" allocated bytes belong to no file."));
+  }
+  if (unallocated > 0) {
+    Serial.print(unallocated); Serial.println(F(" bytes in use were not allocated."));
+  }
+  fsNeedsCheck = !consistent;
+  if (!consistent) {
+    Serial.println(F("Allocation map left unchanged, changes stay disabled. Run 'fsck repair' to unlink bad entries."));
+    return;
+  }
+  if (checkRefcountErrors > 0) {
+    fixRefcounts();
+    Serial.print(F("Refcounts fixed: ")); Serial.println(checkRefcountErrors);
+  }
+  if (leaked > 0 || unallocated > 0) {
+    memcpy(allocMap, owned, sizeof(allocMap));
+    Serial.print(F("Allocation map rebuilt: freed ")); Serial.print(leaked);
+    Serial.print(F(" bytes, allocated ")); Serial.print(unallocated); Serial.println(F(" bytes."));
+  }
+}
+
+void endScrubPass() {
+  scrubPasses++;
+  scrubErrors = scrubPassErrors;
+  scrubPassErrors = 0;
+}
+
+/* Verify the next file of the incremental scrub. A pass counts the errors fsck
+finds in single records (fileProblem) and out of bounds entries. Overlaps and
+refcounts need the whole tree and files below broken dirs are not visited, so
+fsck can find more. Only the scrub counts records missing from the allocation
+map, fsck reports those as bytes in use that were not allocated */
+void scrubStep() {
+  if (scrubWalk.depth == 0) {
+    if (!verifyFile(cwd[0], false)) {
+      scrubPassErrors++;
+      scrubLastBad = cwd[0].address;
+    }
+    if (!cwd[0].isDir || !tableInBounds(cwd[0])) {
+      endScrubPass();
+      return;
+    }
+    walkStart(&scrubWalk, cwd[0]);
+  }
+
+  struct File f;
+  uint8_t step = walkNext(&scrubWalk, &f);
+  if (step == WALK_DIR_DONE) {
+    if (scrubWalk.depth == 0) {
+      endScrubPass();
+    }
+    return;
+  }
+  if (step == WALK_BAD_ENTRY) {
+    scrubPassErrors++;
+    scrubLastBad = scrubWalk.dir[scrubWalk.depth-1];
+    return;
+  }
+
+  // the scrub runs between commands, so it only counts errors (see the scrub command)
+  if (!verifyFile(f, false)) {
+    scrubPassErrors++;
+    scrubLastBad = f.address;
+    return;
+  }
+  // dirs nested deeper than the walk stack are left to fsck
+  if (f.isDir && tableInBounds(f)) {
+    walkPush(&scrubWalk, f);
+  }
 }
 
 void printIndent(uint8_t indentLevel) {
@@ -266,9 +1281,7 @@ void _tree (struct File f, uint8_t indentLevel) {
   Serial.print(f.address); Serial.print(":"); Serial.print(f.name);
   if (!f.isDir) {
     Serial.print(":");
-    for (uint16_t i = f.dataStartAddr; i < f.dataStartAddr+f.dataSize; i++) {
-      Serial.print(char(readROM(i)));
-    }
+    printData(f);
   }
   if (f.isDir) {Serial.print(']');}
   Serial.println();
@@ -285,6 +1298,121 @@ void _tree (struct File f, uint8_t indentLevel) {
 }
 void tree (struct File f) {_tree(f, 0);}
 
+// Directories a recursive walk is in, innermost first. Frames live on the
+// stack of the walk so paths cost no memory beyond the recursion itself
+/* Return whether name matches a pattern with '*' and '?' wildcards */
+bool matchPattern(String &pattern, String &name) {
+  uint8_t p = 0;
+  uint8_t n = 0;
+  int16_t star = -1;
+  uint8_t starMatch = 0;
+  while (n < name.length()) {
+    if (p < pattern.length() && (pattern.charAt(p) == '?' || pattern.charAt(p) == name.charAt(n))) {
+      p++;
+      n++;
+    } else if (p < pattern.length() && pattern.charAt(p) == '*') {
+      star = p++;
+      starMatch = n;
+    } else if (star >= 0) {
+      // let the last '*' swallow one more char
+      p = star+1;
+      n = ++starMatch;
+    } else {
+      return false;
+    }
+  }
+  while (p < pattern.length() && pattern.charAt(p) == '*') {
+    p++;
+  }
+  return p == pattern.length();
+}
+
+/* Warn that a walk started at the end of chain stopped at a directory nested
+deeper than its stack can hold */
+void printTooDeep(uint16_t *chain, uint8_t levels, struct TreeWalk *w, struct File dir) {
+  Serial.print(F("Warning: Not descending into ")); printChain(chain, levels); printWalkPath(w, w->depth);
+  Serial.print(dir.name); Serial.println(F("/, nested too deeply."));
+}
+
+/* Stream the paths of all files below cwd matching pattern (default all) */
+void find(String pattern) {
+  if (pattern.length() == 0) {
+    pattern = "*";
+  }
+  uint16_t chain[PATH_DEPTH];
+  uint8_t levels = resolvePath("", chain);
+  uint16_t matches = 0;
+  struct TreeWalk w;
+  struct File f;
+  walkStart(&w, cwd[cwdPointer]);
+  uint8_t step;
+  while ((step = walkNext(&w, &f)) != WALK_END) {
+    if (step != WALK_FILE) {
+      continue;
+    }
+    if (matchPattern(pattern, f.name)) {
+      printChain(chain, levels); printWalkPath(&w, w.depth); Serial.print(f.name);
+      if (f.isDir) {Serial.print('/');}
+      Serial.println();
+      matches++;
+    }
+    if (f.isDir && tableInBounds(f) && !walkPush(&w, f)) {
+      printTooDeep(chain, levels, &w, f);
+    }
+  }
+  Serial.print(matches); Serial.println(F(" matches."));
+}
+
+/* Bytes used by a file. Shared extents are counted for every file referencing them */
+uint16_t fileUsage(struct File f) {
+  uint16_t usage = recordEnd(f)-f.address;
+  if (f.extentAddr) {
+    usage += EXTENT_HEADER_SIZE+f.dataSize;
+  }
+  return usage;
+}
+
+/* Stream byte totals per directory for path (default cwd), subdirs first */
+void du(String path) {
+  uint16_t chain[PATH_DEPTH];
+  uint8_t levels = resolvePath(path, chain);
+  if (levels == 0) {
+    return;
+  }
+  struct File f = readFile(chain[levels-1]);
+  if (!f.isDir) {
+    Serial.print(fileUsage(f)); Serial.print('\t');
+    printChain(chain, levels-1); Serial.println(f.name);
+    return;
+  }
+
+  // totals[i] sums the dir at walk level i while it is on the stack
+  uint16_t totals[WALK_DEPTH];
+  struct TreeWalk w;
+  walkStart(&w, f);
+  totals[0] = fileUsage(f);
+  uint8_t step;
+  while ((step = walkNext(&w, &f)) != WALK_END) {
+    if (step == WALK_DIR_DONE) {
+      Serial.print(totals[w.depth]); Serial.print('\t');
+      printChain(chain, levels); printWalkPath(&w, w.depth+1); Serial.println();
+      if (w.depth > 0) {
+        totals[w.depth-1] += totals[w.depth];
+      }
+    } else if (step == WALK_FILE) {
+      if (f.isDir && tableInBounds(f) && walkPush(&w, f)) {
+        totals[w.depth-1] = fileUsage(f);
+        continue;
+      }
+      // a dir nested too deeply only counts its own record
+      if (f.isDir && tableInBounds(f)) {
+        printTooDeep(chain, levels, &w, f);
+      }
+      totals[w.depth-1] += fileUsage(f);
+    }
+  }
+}
+
 /* Wipe all deallocated memory regions */
 void setUnallocated(uint8_t value) {
   for (uint16_t i = 0; i < EEPROM.length(); i++) {
@@ -321,10 +1449,14 @@ void findFreeContigMem(uint16_t size, uint16_t *segmentMarker) {
   segmentMarker[1] = prevSegLength;
 }
 
-/* Create standalone file in memory */
-uint16_t createFile(String name, bool isDir, byte *data, uint8_t dataSize) {
+/* Create standalone file in memory. dataFlags are header flags describing
+how data is already encoded (see encodeData) */
+uint16_t createFile(String name, bool isDir, byte *data, uint8_t dataSize, byte dataFlags = 0) {
   uint16_t newFileSegmentMarker[2];
-  uint16_t fileLength = 1+2+name.length()+dataSize;
+  bool packedName = packName(name);
+  uint8_t nameSize = packedName ? packedSize(name.length()) : name.length();
+  bool withCrc = crcNewFiles && !isDir;
+  uint16_t fileLength = 1+2+nameSize+dataSize+withCrc;
   findFreeContigMem(fileLength, newFileSegmentMarker);
   if (newFileSegmentMarker[1] < fileLength) {
     Serial.print(F("Error: No free contiguous memory segment >= ")); Serial.print(fileLength); Serial.println(F(" bytes found."));
@@ -333,18 +1465,34 @@ uint16_t createFile(String name, bool isDir, byte *data, uint8_t dataSize) {
   }
   uint16_t newFileAddr = newFileSegmentMarker[0];
 
-  byte newFileHeaderByte = 0;
-  bitWrite(newFileHeaderByte, 0, isDir);
+  byte newFileHeaderByte = dataFlags;
+  bitWrite(newFileHeaderByte, HDR_DIR, isDir);
+  bitWrite(newFileHeaderByte, HDR_PACKED_NAME, packedName);
+  bitWrite(newFileHeaderByte, HDR_CRC, withCrc);
   writeROM(newFileAddr, newFileHeaderByte);
   writeROM(newFileAddr+1, name.length());
   writeROM(newFileAddr+2, dataSize);
-  for (uint8_t i = 0; i < name.length(); i++) {
-    writeROM(newFileAddr+3+i, name.charAt(i));
+  if (packedName) {
+    byte nameData[nameSize];
+    memset(nameData, 0, nameSize);
+    for (uint8_t i = 0; i < name.length(); i++) {
+      writePacked(nameData, i, packCode(name.charAt(i)));
+    }
+    for (uint8_t i = 0; i < nameSize; i++) {
+      writeROM(newFileAddr+3+i, nameData[i]);
+    }
+  } else {
+    for (uint8_t i = 0; i < nameSize; i++) {
+      writeROM(newFileAddr+3+i, name.charAt(i));
+    }
   }
   for (uint8_t i = 0; i < dataSize; i++) {
-    writeROM(newFileAddr+3+name.length()+i, data[i]);
+    writeROM(newFileAddr+3+nameSize+i, data[i]);
     //Serial.println(char(data[i]));
-    //Serial.println(newFileAddr+3+name.length()+i);
+    //Serial.println(newFileAddr+3+nameSize+i);
+  }
+  if (withCrc) {
+    writeROM(newFileAddr+fileLength-1, fileCrc(readFile(newFileAddr)));
   }
 
   // mark new file space as allocated
@@ -355,13 +1503,78 @@ uint16_t createFile(String name, bool isDir, byte *data, uint8_t dataSize) {
   return newFileAddr;
 }
 
+/* Copy size bytes starting at src into a new unreferenced extent, return its address or 0 */
+uint16_t createExtent(uint16_t src, uint8_t size) {
+  uint16_t segmentMarker[2];
+  uint16_t extentLength = EXTENT_HEADER_SIZE+size;
+  findFreeContigMem(extentLength, segmentMarker);
+  if (segmentMarker[1] < extentLength) {
+    Serial.print(F("Error: No free contiguous memory segment >= ")); Serial.print(extentLength); Serial.println(F(" bytes found."));
+    return 0;
+  }
+  uint16_t extentAddr = segmentMarker[0];
+
+  writeROM(extentAddr, 0);
+  writeROM(extentAddr+1, size);
+  for (uint8_t i = 0; i < size; i++) {
+    writeROM(extentAddr+EXTENT_HEADER_SIZE+i, readROM(src+i));
+  }
+
+  for (uint16_t i = extentAddr; i < extentAddr+extentLength; i++) {
+    setAllocMapPos(i, 1, false);
+  }
+  return extentAddr;
+}
+
+/* Point an existing file at a shared extent and release its previous data */
+void linkToExtent(struct File f, uint16_t extentAddr) {
+  writeMeta(extentAddr, readROM(extentAddr)+1);
+  uint16_t linkAddr = f.address+3+storedNameSize(f);
+  writeTwoBytes(linkAddr, extentAddr);
+
+  if (f.extentAddr) {
+    releaseExtent(f.extentAddr, false);
+    return;
+  }
+
+  // record shrinks to the 2 byte extent pointer (and the unchanged crc), free the remaining bytes
+  bool withCrc = bitRead(f.header, HDR_CRC);
+  if (withCrc) {
+    writeROM(linkAddr+2, readROM(recordEnd(f)-1));
+  }
+  writeMeta(f.address+2, 2);
+  byte header = readROM(f.address);
+  bitSet(header, HDR_SHARED);
+  writeROM(f.address, header);
+  for (uint16_t i = linkAddr+2+withCrc; i < recordEnd(f); i++) {
+    setAllocMapPos(i, 0, false);
+  }
+}
+
+/* Move a file's data into a new shared extent, return the extent address or 0 */
+uint16_t shareFile(struct File f) {
+  uint16_t extentAddr = createExtent(f.dataStartAddr, f.dataSize);
+  if (extentAddr != 0) {
+    linkToExtent(f, extentAddr);
+  }
+  return extentAddr;
+}
+
 /* Create file and update parent dir */
-uint16_t mkfile(String name, bool isDir, byte *data, uint8_t dataSize) {
+uint16_t mkfile(String name, bool isDir, byte *data, uint8_t dataSize, byte dataFlags = 0) {
+  if (!checkWritable()) {
+    return 0;
+  }
+  resetScrub();
+  if (name.length() == 0) {
+    Serial.println(F("Error: Missing file name"));
+    return 0;
+  }
   struct File f = getFileByName(name);
 
   if (f.name != F("ERR_FILE_NOT_FOUND")) {
     Serial.print(F("Error: File already exists: ")); Serial.println(name);
-    return;
+    return 0;
   }
 
   struct File parentDirectory = cwd[cwdPointer];
@@ -420,10 +1633,8 @@ uint16_t mkfile(String name, bool isDir, byte *data, uint8_t dataSize) {
       Serial.println(F("Really shouldn't happen :("));
     }
 
-    // update our parent dir File instance
-    parentDirectory.address = parentDirNewAddr;
-    parentDirectory.dataSize += 2;
-    parentDirectory.dataStartAddr = parentDirectory.address+3+parentDirectory.name.length();
+    // update our parent dir File instance (the moved copy may encode its name differently)
+    parentDirectory = readFile(parentDirNewAddr);
   } else {
     // Not moving the parent dir
     setAllocMapPos(parentDirectory.dataStartAddr+parentDirectory.dataSize, 1, false);
@@ -431,18 +1642,18 @@ uint16_t mkfile(String name, bool isDir, byte *data, uint8_t dataSize) {
 
     uint8_t prevLength = readROM(parentDirectory.address+2);
     parentDirectory.dataSize = prevLength+2;
-    writeROM(parentDirectory.address+2, prevLength+2);
+    writeMeta(parentDirectory.address+2, prevLength+2);
   }
 
-  uint16_t newFileAddr = createFile(name, isDir, data, dataSize);
+  uint16_t newFileAddr = createFile(name, isDir, data, dataSize, dataFlags);
   //Serial.print(F("Created file at new address: ")); Serial.println(newFileAddr);
 
   if (newFileAddr == 0) {
     Serial.println(F("Unable to create file. Reverting all changes.."));
     uint8_t prevLength = readROM(parentDirectory.address+2);
-    writeROM(parentDirectory.address+2, prevLength-2);
+    writeMeta(parentDirectory.address+2, prevLength-2);
     parentDirectory.dataSize -= 2;
-    parentDirectory.dataStartAddr = parentDirectory.address+3+parentDirectory.name.length();
+    parentDirectory.dataStartAddr = parentDirectory.address+3+storedNameSize(parentDirectory);
 
     setAllocMapPos(parentDirectory.dataStartAddr+parentDirectory.dataSize, 1, false);
     setAllocMapPos(parentDirectory.dataStartAddr+parentDirectory.dataSize+1, 1, false);
@@ -459,6 +1670,10 @@ uint16_t mkfile(String name, bool isDir, byte *data, uint8_t dataSize) {
 
 /* Recursively remove file(s) */
 void rm(String name, bool deepRemove) {
+  if (!checkWritable()) {
+    return;
+  }
+  resetScrub();
   struct File f = getFileByName(name);
 
   if (f.name == F("ERR_FILE_NOT_FOUND")) {
@@ -486,7 +1701,7 @@ void rm(String name, bool deepRemove) {
   // decrease parent dir subfile count
   int8_t prevParentDataSize = parentDirectory.dataSize;
   parentDirectory.dataSize -= 2;
-  writeROM(parentDirectory.address+2, prevParentDataSize-2);
+  writeMeta(parentDirectory.address+2, prevParentDataSize-2);
 
   // switch last parent dir subfile addr data with deleted subfile addr data
   writeTwoBytes(parentDirectory.dataStartAddr+parentSubfileIndexOfDeleted*2, parentDirectorySubfilesAddr[prevParentDataSize/2-1]);
@@ -500,15 +1715,105 @@ void rm(String name, bool deepRemove) {
   Serial.print(F("Removed ")); printCwd(); Serial.println(f.name);
 }
 
+/* Copy a file, sharing its data extent instead of duplicating it where possible */
+void cp(String src, String dst) {
+  if (!checkWritable()) {
+    return;
+  }
+  struct File f = getFileByName(src);
+  if (f.name == F("ERR_FILE_NOT_FOUND")) {
+    Serial.println(F("Error: File not found"));
+    return;
+  }
+  if (f.isDir) {
+    Serial.println(F("Error: Cannot copy directories"));
+    return;
+  }
+  if (dst.length() == 0) {
+    Serial.println(F("Error: Missing file name"));
+    return;
+  }
+  if (getFileByName(dst).name != F("ERR_FILE_NOT_FOUND")) {
+    Serial.print(F("Error: File already exists: ")); Serial.println(dst);
+    return;
+  }
+
+  bool share = f.extentAddr ? readROM(f.extentAddr) < 0xFF : f.dataSize >= SHARE_MIN_SIZE;
+  uint16_t extentAddr = f.extentAddr;
+  if (share && !extentAddr) {
+    // the source is only linked to the new extent once the copy exists
+    extentAddr = createExtent(f.dataStartAddr, f.dataSize);
+    share = extentAddr != 0;
+  }
+
+  if (!share) {
+    byte data[f.dataSize];
+    for (uint8_t i = 0; i < f.dataSize; i++) {
+      data[i] = readROM(f.dataStartAddr+i);
+    }
+    mkfile(dst, false, data, f.dataSize, f.header & DATA_ENCODING_MASK);
+    return;
+  }
+
+  // the copy only holds a pointer to the extent
+  byte link[2] = {highByte(extentAddr), lowByte(extentAddr)};
+  uint16_t newFileAddr = mkfile(dst, false, link, 2, 1<<HDR_SHARED | (f.header & DATA_ENCODING_MASK));
+  if (newFileAddr == 0) {
+    if (!f.extentAddr) {
+      // still unreferenced, so this frees it
+      releaseExtent(extentAddr, false);
+    }
+    return;
+  }
+  if (!f.extentAddr) {
+    linkToExtent(f, extentAddr);
+  }
+  writeMeta(extentAddr, readROM(extentAddr)+1);
+}
+
+/* Replace file content. A new record is written and linked into the parent dir,
+so other files sharing the old extent keep their content (copy on write) */
+void writeFile(String name, byte *data, uint8_t dataSize, byte dataFlags) {
+  if (!checkWritable()) {
+    return;
+  }
+  struct File f = getFileByName(name);
+  if (f.name == F("ERR_FILE_NOT_FOUND")) {
+    Serial.println(F("Error: File not found"));
+    return;
+  }
+  if (f.isDir) {
+    Serial.println(F("Error: Not a file"));
+    return;
+  }
+
+  uint16_t newFileAddr = createFile(name, false, data, dataSize, dataFlags);
+  if (newFileAddr == 0) {
+    Serial.println(F("Unable to write file. No changes were made."));
+    return;
+  }
+
+  struct File parentDirectory = cwd[cwdPointer];
+  for (uint16_t i = parentDirectory.dataStartAddr; i < parentDirectory.dataStartAddr+parentDirectory.dataSize; i+=2) {
+    if (readTwoBytes(i) == f.address) {
+      writeTwoBytes(i, newFileAddr);
+      break;
+    }
+  }
+
+  // release the old record (and drop its extent reference)
+  markInAllocMap(f, 0, false);
+  Serial.println(F("Wrote file successfully."));
+}
+
 /* Print file content to serial */
 void cat(String name) {
   struct File f = getFileByName(name);
   if (f.name == F("ERR_FILE_NOT_FOUND")) {
     Serial.println(F("File not found."));
+    return;
   }
-  for (uint16_t i = f.dataStartAddr; i < f.dataStartAddr+f.dataSize; i++) {
-    Serial.print(char(readROM(i)));
-  }
+  printData(f);
   Serial.println();
 }
 
@@ -572,6 +1877,84 @@ void printMemStats() {
   Serial.print(sum); Serial.print("/"); Serial.print(EEPROM.length()); Serial.println(F(" bytes allocated."));
 }
 
+struct File dedupTarget;
+uint8_t dedupMerged;
+bool dedupFull;
+
+/* Return whether two files have identical data. Encoding is deterministic,
+so comparing the stored bytes and encoding flags is enough */
+bool sameContent(struct File a, struct File b) {
+  if (a.dataSize != b.dataSize || (a.header & DATA_ENCODING_MASK) != (b.header & DATA_ENCODING_MASK)) {
+    return false;
+  }
+  for (uint8_t i = 0; i < a.dataSize; i++) {
+    if (readROM(a.dataStartAddr+i) != readROM(b.dataStartAddr+i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Merge f into the extent of dedupTarget if their content is identical */
+void dedupMatch(struct File f) {
+  if (f.isDir || f.address == dedupTarget.address || dedupFull) {
+    return;
+  }
+  f = readFile(f.address);
+  if (f.extentAddr && f.extentAddr == dedupTarget.extentAddr) {
+    return;
+  }
+  if (!sameContent(f, dedupTarget)) {
+    return;
+  }
+
+  if (!dedupTarget.extentAddr) {
+    if (f.extentAddr) {
+      // reuse the extent f already points to
+      linkToExtent(dedupTarget, f.extentAddr);
+      dedupTarget = readFile(dedupTarget.address);
+      dedupMerged++;
+      return;
+    }
+    if (shareFile(dedupTarget) == 0) {
+      dedupFull = true;
+      return;
+    }
+    dedupTarget = readFile(dedupTarget.address);
+  }
+  if (readROM(dedupTarget.extentAddr) == 0xFF) {
+    return;
+  }
+  linkToExtent(f, dedupTarget.extentAddr);
+  dedupMerged++;
+}
+
+void dedupVisit(struct File f) {
+  if (f.isDir) {
+    return;
+  }
+  dedupTarget = readFile(f.address);
+  if (dedupTarget.dataSize < SHARE_MIN_SIZE) {
+    return;
+  }
+  walkTree(cwd[0], dedupMatch);
+}
+
+/* Merge files with identical content into shared extents */
+void dedup() {
+  if (!checkWritable()) {
+    return;
+  }
+  dedupMerged = 0;
+  dedupFull = false;
+  walkTree(cwd[0], dedupVisit);
+  Serial.print(F("Merged ")); Serial.print(dedupMerged); Serial.println(F(" files."));
+  if (dedupFull) {
+    Serial.println(F("Warning: Ran out of memory for new extents, some duplicates were kept."));
+  }
+  printMemStats();
+}
+
 /* Move up one level in the file hierarchy ("cd ..") */
 void cdPop() {
   if (cwdPointer > 0) {
@@ -604,6 +1987,11 @@ bool cd(String dir) {
     return false;
   }
 
+  if (cwdPointer+1 >= PATH_DEPTH) {
+    Serial.println(F("Error: Directory nested too deeply."));
+    return false;
+  }
+
   cwdPointer++;
   cwd[cwdPointer] = cdInto;
   return true;
@@ -612,35 +2000,62 @@ bool cd(String dir) {
 /* Check whether a filesystem is readable and if so, read its header
 and return true, otherwise return false */
 bool readfs() {
-  if (readROM(0) != 0xFF) {
+  resetLog();
+  resetScrub();
+  fsMounted = false;
+  uint8_t magic = readROM(0);
+  if (magic != FS_MAGIC && magic != FS_MAGIC_LOG) {
     Serial.println(F("Error: 'Filesystem header not detected.'"));
     return false;
   }
   fs_size = readTwoBytes(1);
+  if (fs_size > EEPROM.length() || (magic == FS_MAGIC_LOG && fs_size < 16+LOG_SIZE)) {
+    Serial.println(F("Error: 'Filesystem size corrupted.'"));
+    return false;
+  }
   if (fs_size < 16) {
     Serial.println(F("Warning: Filesystem size may be corrupted or filesystem too small."));
   }
   if (readROM(fs_size-1) != 0xEE) {
     Serial.println(F("Error: 'Filesystem header found but terminator overwritten. Ignoring..'"));
   }
+  if (magic == FS_MAGIC_LOG) {
+    logStart = fs_size-1-LOG_SIZE;
+    replayLog();
+    logMode = true;
+  }
   uint16_t rootDirAddr = readTwoBytes(3);
+  if (rootDirAddr < HEADER_SIZE || rootDirAddr >= fs_size) {
+    Serial.println(F("Error: 'Root directory address corrupted.'"));
+    return false;
+  }
   cwd[0] = readFile(rootDirAddr);
   cwdPointer = 0;
-  createAllocMap();
-  Serial.print(F("Found filesystem of ")); Serial.print(fs_size); Serial.println(F(" bytes starting from address 0"));
+  fsNeedsCheck = !createAllocMap();
+  if (fsNeedsCheck) {
+    Serial.println(F("Warning: Filesystem is inconsistent, changes are disabled until fsck passes."));
+  }
+  fsMounted = true;
+  Serial.print(F("Found filesystem of ")); Serial.print(fs_size); Serial.print(F(" bytes starting from address 0"));
+  if (logMode) {
+    Serial.print(F(" (log mode)"));
+  }
+  Serial.println();
   printMemStats();
   return true;
 }
 
 /* Create new filesystem starting at position 0 with length 'size' [1, 65536]
-return whether the operation was successful */
-bool mkfs(uint16_t size) {
-  if (size < 16) {
+(log mode: [16+LOG_SIZE, 1024]) return whether the operation was successful */
+bool mkfs(uint16_t size, bool withLog) {
+  if (size < 16 || (withLog && (size < 16+LOG_SIZE || size > 1024))) {
     return false;
   }
+  resetLog();
+  fsMounted = false;
 
   // write fs header
-  writeROM(0, 0xFF); // fs metadata
+  writeROM(0, withLog ? FS_MAGIC_LOG : FS_MAGIC); // fs metadata
   writeROM(1, highByte(size)); // fs size
   writeROM(2, lowByte(size));
   writeROM(3, 0); // root dir address
@@ -655,6 +2070,13 @@ bool mkfs(uint16_t size) {
   writeROM(10, 'o');
   writeROM(11, 't');
 
+  // clear log region
+  if (withLog) {
+    for (uint16_t i = size-1-LOG_SIZE; i < size-1; i++) {
+      writeROM(i, 0);
+    }
+  }
+
   // write fs terminator
   writeROM(size-1, 0xEE);
   return true;
@@ -668,6 +2090,17 @@ void setup() {
 
 
 void loop() {
+  // fold logged metadata home in the background once the log fills up
+  if (logMode && logPending >= LOG_RECORDS*3/4) {
+    cleanLog(LOG_CLEAN_STEP);
+  }
+
+  if (fsMounted && scrubEnabled) {
+    for (uint8_t i = 0; i < SCRUB_BATCH; i++) {
+      scrubStep();
+    }
+  }
+
   // ugly command parsing logic :/
   if (Serial.available() > 0) {
     commandString = Serial.readStringUntil('\n');
@@ -693,7 +2126,7 @@ void loop() {
     } else if (command[0] == F("ping")) {
       Serial.println(F("pong"));
     } else if (command[0] == F("mkfs")) {
-      bool result = mkfs(command[1].toInt());
+      bool result = mkfs(command[1].toInt(), command[2] == F("log"));
       if (result) {
         readfs();
         Serial.println(F("mkfs successful"));
@@ -736,15 +2169,51 @@ void loop() {
       byte data[0];
       mkfile(command[1], true, data, 0);
     } else if (command[0] == F("mkfile")) {
-      byte data[command[2].length()];
+      byte data[command[2].length()+1];
       command[2].toCharArray(data, command[2].length()+1);
-      mkfile(command[1], false, data, command[2].length());
+      byte dataFlags = 0;
+      uint8_t dataSize = encodeData(data, command[2].length(), &dataFlags);
+      mkfile(command[1], false, data, dataSize, dataFlags);
+    } else if (command[0] == F("write")) {
+      byte data[command[2].length()+1];
+      command[2].toCharArray(data, command[2].length()+1);
+      byte dataFlags = 0;
+      uint8_t dataSize = encodeData(data, command[2].length(), &dataFlags);
+      writeFile(command[1], data, dataSize, dataFlags);
+    } else if (command[0] == F("cp")) {
+      cp(command[1], command[2]);
+    } else if (command[0] == F("dedup")) {
+      dedup();
     } else if (command[0] == F("memstats")) {
       printMemStats();
-    }/* else if (command[0] == F("flush")) {
-      flushBuffer();
+    } else if (command[0] == F("find")) {
+      find(command[1]);
+    } else if (command[0] == F("du")) {
+      du(command[1]);
+    } else if (command[0] == F("fsck")) {
+      fsck(command[1] == F("repair"));
+    } else if (command[0] == F("scrub")) {
+      if (command[1] == F("on") || command[1] == F("off")) {
+        scrubEnabled = command[1] == F("on");
+      } else {
+        Serial.print(scrubPasses); Serial.print(F(" scrub passes, ")); Serial.print(scrubErrors); Serial.print(F(" errors in the last pass"));
+        if (scrubErrors > 0) {
+          Serial.print(F(", last bad file at ")); Serial.print(scrubLastBad);
+        }
+        Serial.println('.');
+      }
+    } else if (command[0] == F("crc")) {
+      if (command[1] == F("on") || command[1] == F("off")) {
+        crcNewFiles = command[1] == F("on");
+      } else {
+        Serial.print(F("CRC for new files is ")); Serial.println(crcNewFiles ? F("on") : F("off"));
+      }
     } else if (command[0] == F("writecycles")) {
       Serial.println(totalWriteCycles);
+    } else if (command[0] == F("metacycles")) {
+      Serial.println(metaWriteCycles);
+    }/* else if (command[0] == F("flush")) {
+      flushBuffer();
     }*/
   }
 }
@@ -5,6 +5,7 @@ import serial
 import time
 from tqdm import tqdm
 import string
+import sys
 
 
 def sample_chars(n):
@@ -51,14 +52,33 @@ def read(name):
     return data
 
 
+def counter(name):
+    ser.write(f'{name}\n'.encode('utf-8'))
+    try:
+        value = int(ser.readline().decode().strip())
+        time.sleep(0.1)
+        wait_flush(wait_for_input=False)
+        return value
+    except ValueError:
+        ser.readline()
+        return None
+
+
+# pass 'log' to run the same aging workload against a log mode filesystem.
+# Reported are the total number of physical EEPROM writes ('writecycles') and
+# the physical writes to metadata home addresses ('metacycles': root pointer,
+# dir sizes and tables, refcounts), which log mode is meant to reduce.
+mkfs_mode = ' log' if 'log' in sys.argv[1:] else ''
+
 actual_iters = 0
 total_time = 0
 files = []
 writecycles = 0
+metacycles = 0
 with serial.Serial('/dev/ttyUSB1', 2000000, timeout=1) as ser:
     ser.write(f'wipe\n'.encode('utf-8'))
     wait_flush()
-    ser.write(f'mkfs 1024\n'.encode('utf-8'))
+    ser.write(f'mkfs 1024{mkfs_mode}\n'.encode('utf-8'))
     wait_flush()
     ser.write(f'readfs\n'.encode('utf-8'))
     wait_flush()
@@ -85,12 +105,6 @@ with serial.Serial('/dev/ttyUSB1', 2000000, timeout=1) as ser:
 
         if i % 10 == 0:
             print(actual_iters, total_time/actual_iters)
-            ser.write('writecycles\n'.encode('utf-8'))
-            try:
-                writecycles = int(ser.readline().decode().strip())
-                print('writecycles: ', writecycles, i)
-                time.sleep(0.1)
-                wait_flush(wait_for_input=False)
-            except ValueError:
-                ser.readline()
-                pass
+            writecycles = counter('writecycles') or writecycles
+            metacycles = counter('metacycles') or metacycles
+            print('writecycles: ', writecycles, 'metacycles: ', metacycles, i)